@@ -260,10 +260,12 @@ static void stm32f405_soc_realize(DeviceState *dev_soc, Error **errp)
                         GPIO_ADDR + (i * STM32_GPIO_PERIPHERAL_SIZE));
 
         qdev_connect_gpio_out(DEVICE(&s->rcc), STM32_RCC_GPIO_IRQ_OFFSET + i,
-                              qdev_get_gpio_in_named(dev, "reset-in", 0));
+                              qdev_get_gpio_in_named(dev, "in",
+                                                     STM32_GPIO_LINE_RESET));
         qdev_connect_gpio_out(DEVICE(&s->rcc),
                               STM32_RCC_GPIO_IRQ_OFFSET + i + STM32_RCC_NIRQS,
-                              qdev_get_gpio_in_named(dev, "enable-in", 0));
+                              qdev_get_gpio_in_named(dev, "in",
+                                                     STM32_GPIO_LINE_ENABLE));
         for (int j = 0; j < STM32_GPIO_NPINS; j++) {
             qdev_connect_gpio_out_named(dev, "input-out", j,
                                         qdev_get_gpio_in(DEVICE(&s->syscfg),
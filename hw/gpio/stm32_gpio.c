@@ -12,7 +12,12 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/arm/stm32.h"
@@ -20,50 +25,141 @@
 #include "migration/vmstate.h"
 #include "trace.h"
 
-static void stm32_gpio_update_state(STM32GPIOState *s)
+/*
+ * Return a mask with bit i set iff the i-th 2-bit field of reg equals val.
+ * Used to turn the 2-bit-per-pin MODER/PUPDR registers into 1-bit-per-pin
+ * masks, so that update_state can compose all pins at once instead of
+ * extracting each field individually.
+ */
+static uint16_t stm32_gpio_pair_eq_mask(uint32_t reg, unsigned val)
 {
-    bool prev_id, new_id, od, in, in_mask;
-    uint8_t mode, pupd;
+    uint32_t diff = reg ^ (val * 0x55555555u);
 
-    for (size_t i = 0; i < s->ngpio; i++) {
-        prev_id = extract32(s->idr, i, 1);
-        od = extract32(s->odr, i, 1);
-        in = extract32(s->in, i, 1);
-        in_mask = extract32(s->in_mask, i, 1);
+    return half_unshuffle32(~(diff | (diff >> 1)) & 0x55555555u);
+}
 
-        mode = extract32(s->moder, i * 2, 2);
-        pupd = extract32(s->pupdr, i * 2, 2);
+/*
+ * Refresh the cached pin masks after MODER or PUPDR changed, so that
+ * update_state does not have to re-derive them on every call.
+ */
+static void stm32_gpio_recompute_masks(STM32GPIOState *s)
+{
+    uint32_t pins = s->pin_mask;
+
+    s->mode_output_mask =
+        stm32_gpio_pair_eq_mask(s->moder, STM32_GPIO_MODE_OUTPUT) & pins;
+    s->mode_input_mask =
+        stm32_gpio_pair_eq_mask(s->moder, STM32_GPIO_MODE_INPUT) & pins;
+    s->pupd_up_mask =
+        stm32_gpio_pair_eq_mask(s->pupdr, STM32_GPIO_PULL_UP) & pins;
+}
 
-        /* Pin both driven externally and internally */
-        if (mode == STM32_GPIO_MODE_OUTPUT && in_mask) {
-            qemu_log_mask(LOG_GUEST_ERROR, "GPIO pin %zu short circuited\n", i);
-        }
+/*
+ * Recompute IDR from the current register and input state. Most register
+ * writes (LCKR, AFRL, ...) cannot change IDR, so unless the write handler
+ * flagged the state as dirty there is nothing to do. Callers that change
+ * state outside of the register write path (reset, RCC, external inputs)
+ * pass force=true.
+ */
+static void stm32_gpio_update_state_common(STM32GPIOState *s, bool force,
+                                           bool fire_pin_irqs)
+{
+    uint32_t pins, output, prev_idr, new_idr, shorted, changed;
 
-        if (in_mask) {
-            /* The pin is driven by external device */
-            new_id = in;
-        } else if (mode == STM32_GPIO_MODE_OUTPUT) {
-            /* The pin is driven by internal circuit */
-            new_id = od;
-        } else {
-            /* Floating? Apply pull-up resistor */
-            new_id = pupd == STM32_GPIO_PULL_UP;
-        }
+    if (!s->dirty_state && !force) {
+        return;
+    }
+
+    pins = s->pin_mask;
+    output = s->mode_output_mask;
 
-        /* Update IDR */
-        s->idr = deposit32(s->idr, i, 1, new_id);
+    /* Pins both driven externally and internally */
+    shorted = output & s->in_mask;
+    if (unlikely(shorted)) {
+        do {
+            int i = ctz32(shorted);
+
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "GPIO pin %d short circuited\n", i);
+            shorted &= shorted - 1;
+        } while (shorted);
+    }
 
-        /* If pin is in input mode and IDR has changed, trigger an IRQ */
-        if (new_id != prev_id) {
-            if (mode == STM32_GPIO_MODE_INPUT) {
-                qemu_set_irq(s->input_irq[i], new_id);
-            }
+    /*
+     * Externally driven pins take their input value, output pins take ODR,
+     * and the remaining (floating) pins read back the pull-up setting.
+     */
+    prev_idr = s->idr;
+    new_idr = (s->in & s->in_mask) |
+              (~s->in_mask &
+               ((s->odr & output) | (s->pupd_up_mask & ~output)));
+    new_idr &= pins;
+    /*
+     * Publish the fully composed value with a single atomic store, so a
+     * concurrent IDR read from another thread never sees a torn update.
+     */
+    qatomic_set(&s->idr, (prev_idr & ~pins) | new_idr);
+
+    /*
+     * Drive the IRQ of each input pin whose level differs from what was
+     * last driven on its line; lines already at the right level are not
+     * re-driven through the IRQ machinery.
+     */
+    if (fire_pin_irqs) {
+        changed = (new_idr ^ s->last_irq_out) & s->mode_input_mask;
+        while (changed) {
+            int i = ctz32(changed);
+
+            qemu_set_irq(s->input_irq[i], (new_idr >> i) & 1);
+            changed &= changed - 1;
         }
     }
-    /* Notify that GPIO has changed its state */
-    qemu_irq_pulse(s->state_irq);
+    /*
+     * Remember the driven level of every pin, not just the ones currently
+     * in input mode: a pin leaving and re-entering input mode must only
+     * fire its IRQ if the level differs from what its line last carried.
+     */
+    s->last_irq_out = (s->last_irq_out & ~s->mode_input_mask) |
+                      (new_idr & s->mode_input_mask);
+    s->dirty_state = false;
+
+    /* Notify that GPIO has changed its state, but only when it did */
+    if ((prev_idr & pins) != new_idr) {
+        qemu_irq_pulse(s->state_irq);
+    }
+}
+
+static void stm32_gpio_update_state(STM32GPIOState *s, bool force)
+{
+    stm32_gpio_update_state_common(s, force, true);
 }
 
+/*
+ * Bottom half scheduled by the MMIO write path. Guest firmware tends to
+ * reconfigure several registers back to back (e.g. MODER, PUPDR and ODR
+ * during init); deferring the recompute to a bottom half folds such a
+ * burst into a single state update and state_irq pulse.
+ */
+static void stm32_gpio_update_bh(void *opaque)
+{
+    stm32_gpio_update_state(STM32_GPIO(opaque), false);
+}
+
+/*
+ * Non-zero register reset values per family and port. Ports not listed
+ * here reset to all-zeroes. New families only need a new table entry.
+ */
+static const struct stm32_gpio_reset_default {
+    uint32_t family;
+    uint32_t port;
+    uint32_t moder;
+    uint32_t ospeedr;
+    uint32_t pupdr;
+} stm32_gpio_reset_defaults[] = {
+    { STM32_F4, STM32_GPIO_PORT_A, 0xA8000000, 0x00000000, 0x64000000 },
+    { STM32_F4, STM32_GPIO_PORT_B, 0x00000280, 0x000000C0, 0x00000100 },
+};
+
 static void stm32_gpio_reset(DeviceState *dev)
 {
     STM32GPIOState *s = STM32_GPIO(dev);
@@ -84,18 +180,25 @@ static void stm32_gpio_reset(DeviceState *dev)
     s->afhr = 0;
 
     /* Next, we check model particularities */
-    if (s->family == STM32_F4) {
-        if (s->port == STM32_GPIO_PORT_A) {
-            s->moder     = 0xA8000000;
-            s->pupdr   = 0x64000000;
-        } else if (s->port == STM32_GPIO_PORT_B) {
-            s->moder     = 0x00000280;
-            s->ospeedr = 0x000000C0;
-            s->pupdr   = 0x00000100;
+    for (size_t i = 0; i < ARRAY_SIZE(stm32_gpio_reset_defaults); i++) {
+        const struct stm32_gpio_reset_default *def =
+            &stm32_gpio_reset_defaults[i];
+
+        if (def->family == s->family && def->port == s->port) {
+            s->moder = def->moder;
+            s->ospeedr = def->ospeedr;
+            s->pupdr = def->pupdr;
+            break;
         }
     }
 
-    stm32_gpio_update_state(s);
+    stm32_gpio_recompute_masks(s);
+    /*
+     * Recompute IDR but do not re-drive the per-pin IRQs for whatever
+     * changed across the reset: the guest re-reads IDR anyway and
+     * downstream peripherals are notified through state_irq.
+     */
+    stm32_gpio_update_state_common(s, true, false);
 }
 
 static void stm32_gpio_irq_reset(void *opaque, int line, int value)
@@ -110,7 +213,7 @@ static void stm32_gpio_irq_reset(void *opaque, int line, int value)
         if (s->reset) {
             stm32_gpio_reset(DEVICE(s));
         } else {
-            stm32_gpio_update_state(s);
+            stm32_gpio_update_state(s, true);
         }
     }
 }
@@ -124,7 +227,7 @@ static void stm32_gpio_irq_enable(void *opaque, int line, int value)
     bool prev_enable = s->enable;
     s->enable = value != 0;
     if (prev_enable != s->enable) {
-        stm32_gpio_update_state(s);
+        stm32_gpio_update_state(s, true);
     }
 }
 
@@ -136,7 +239,9 @@ static void stm32_gpio_irq_set(void *opaque, int line, int value)
 
     assert(line >= 0 && line < s->ngpio);
 
-    s->in_mask = deposit32(s->in_mask, line, 1, value >= 0);
+    uint32_t bit = 1u << line;
+
+    s->in_mask = (s->in_mask & ~bit) | ((uint32_t)(value >= 0) << line);
 
     /*
      * If value < 0, the pin is connected to a load.
@@ -144,82 +249,94 @@ static void stm32_gpio_irq_set(void *opaque, int line, int value)
      * If value > 0, the pin is high.
      */
     if (value >= 0) {
-        s->in = deposit32(s->in, line, 1, value != 0);
+        s->in = (s->in & ~bit) | ((uint32_t)(value != 0) << line);
     }
 
-    stm32_gpio_update_state(s);
+    stm32_gpio_update_state(s, true);
 }
 
-
-static uint64_t stm32_gpio_read(void *opaque, hwaddr offset, unsigned int size)
+/*
+ * Demultiplex the consolidated "in" GPIO array. A single qdev input
+ * array keeps the per-instance IRQ metadata compact; the line number
+ * encodes reset, enable or one of the external pin inputs.
+ */
+static void stm32_gpio_irq_in(void *opaque, int line, int value)
 {
-    STM32GPIOState *s = STM32_GPIO(opaque);
-    uint64_t r = 0;
-
-    if (!s->enable) {
-        qemu_log_mask(
-            LOG_GUEST_ERROR, "%s: GPIO peripheral is disabled\n", __func__
-        );
-        return 0;
-    }
-
-    switch (offset) {
-    case STM32_GPIO_REG_MODER:
-        r = s->moder;
+    switch (line) {
+    case STM32_GPIO_LINE_RESET:
+        stm32_gpio_irq_reset(opaque, 0, value);
         break;
 
-    case STM32_GPIO_REG_OTYPER:
-        r = s->otyper;
+    case STM32_GPIO_LINE_ENABLE:
+        stm32_gpio_irq_enable(opaque, 0, value);
         break;
 
-    case STM32_GPIO_REG_OSPEEDR:
-        r = s->ospeedr;
-        break;
-
-    case STM32_GPIO_REG_PUPDR:
-        r = s->pupdr;
-        break;
-
-    case STM32_GPIO_REG_IDR:
-        r = s->idr;
-        break;
-
-    case STM32_GPIO_REG_ODR:
-        r = s->odr;
-        break;
-
-    case STM32_GPIO_REG_BSRR:
-        break; /* BSRR is write-only */
-
-    case STM32_GPIO_REG_LCKR:
-        r = s->lckr;
+    default:
+        stm32_gpio_irq_set(opaque, line - STM32_GPIO_LINE_INPUT(0), value);
         break;
+    }
+}
 
-    case STM32_GPIO_REG_AFRL:
-        r = s->aflr;
-        break;
+/*
+ * Register dispatch table, indexed by offset >> 2. Registers backed by a
+ * plain 32-bit field are described by their offset within STM32GPIOState;
+ * BSRR and BRR have no backing field and keep dedicated handling in the
+ * write callback.
+ */
+typedef struct STM32GPIORegDef {
+    uint16_t off;  /* backing field within STM32GPIOState, 0: none */
+    bool writable; /* accepts a plain 32-bit store */
+    bool dirties;  /* a write may change IDR */
+    bool remask;   /* a write invalidates the cached pin masks */
+} STM32GPIORegDef;
+
+#define STM32_GPIO_REG(reg, field, writable, dirties, remask) \
+    [STM32_GPIO_REG_##reg >> 2] = \
+        { offsetof(STM32GPIOState, field), writable, dirties, remask }
+
+static const STM32GPIORegDef stm32_gpio_regs[] = {
+    STM32_GPIO_REG(MODER, moder, true, true, true),
+    STM32_GPIO_REG(OTYPER, otyper, true, false, false),
+    STM32_GPIO_REG(OSPEEDR, ospeedr, true, false, false),
+    STM32_GPIO_REG(PUPDR, pupdr, true, true, true),
+    STM32_GPIO_REG(IDR, idr, false, false, false), /* read-only */
+    STM32_GPIO_REG(ODR, odr, true, true, false),
+    /* BSRR is write-only and dispatched through its own sub-region */
+    [STM32_GPIO_REG_BSRR >> 2] = { 0, false, true },
+    STM32_GPIO_REG(LCKR, lckr, true, false, false),
+    STM32_GPIO_REG(AFRL, aflr, true, false, false),
+    STM32_GPIO_REG(AFRH, afhr, true, false, false),
+    [STM32_GPIO_REG_BRR >> 2] = { 0, false, true }, /* write-only, not on F4 */
+};
 
-    case STM32_GPIO_REG_AFRH:
-        r = s->afhr;
-        break;
+/*
+ * Out of line and cold so the log string formatting stays out of the
+ * i-cache footprint of the MMIO fast path.
+ */
+static __attribute__((noinline, cold)) void
+stm32_gpio_bad_offset(const char *func, const char *dir, hwaddr offset)
+{
+    qemu_log_mask(LOG_GUEST_ERROR, "%s: bad %s offset 0x%" HWADDR_PRIx "\n",
+                  func, dir, offset);
+}
 
-    case STM32_GPIO_REG_BRR:
-        if (s->family != STM32_F4) {
-            break; /* BRR is write-only */
-        }
-        /* STM32F4xx SoCs do not have this register */
-        qemu_log_mask(
-            LOG_GUEST_ERROR,
-            "%s: bad read offset 0x%" HWADDR_PRIx "\n",  __func__, offset
-        );
-        break;
+static uint64_t stm32_gpio_read(void *opaque, hwaddr offset, unsigned int size)
+{
+    STM32GPIOState *s = STM32_GPIO(opaque);
+    unsigned idx = offset >> 2;
+    uint64_t r = 0;
 
-    default:
-        qemu_log_mask(
-            LOG_GUEST_ERROR,
-            "%s: bad read offset 0x%" HWADDR_PRIx "\n",  __func__, offset
-        );
-    }
+    if (unlikely(idx >= ARRAY_SIZE(stm32_gpio_regs) ||
+                 (offset == STM32_GPIO_REG_BRR && s->family == STM32_F4))) {
+        /* STM32F4xx SoCs do not have the BRR register */
+        stm32_gpio_bad_offset(__func__, "read", offset);
+    } else if (offset == STM32_GPIO_REG_IDR) {
+        /* Flush any update still pending in the bottom half */
+        stm32_gpio_update_state(s, false);
+        r = qatomic_read(&s->idr);
+    } else if (stm32_gpio_regs[idx].off) {
+        r = *(const uint32_t *)((const char *)s + stm32_gpio_regs[idx].off);
+    } /* else: BSRR and BRR are write-only and read as zero */
 
     trace_stm32_gpio_read(offset, r);
 
@@ -230,93 +347,132 @@ static void stm32_gpio_write(void *opaque, hwaddr offset,
                              uint64_t value, unsigned int size)
 {
     STM32GPIOState *s = STM32_GPIO(opaque);
+    unsigned idx = offset >> 2;
 
     trace_stm32_gpio_write(offset, value);
 
-    if (!s->enable) {
-        qemu_log_mask(
-            LOG_GUEST_ERROR, "%s: GPIO peripheral is disabled\n", __func__
-        );
+    if (unlikely(idx >= ARRAY_SIZE(stm32_gpio_regs))) {
+        stm32_gpio_bad_offset(__func__, "write", offset);
         return;
     }
 
     switch (offset) {
-
-    case STM32_GPIO_REG_MODER:
-        s->moder = value;
-        break;
-
-    case STM32_GPIO_REG_OTYPER:
-        s->otyper = value;
-        break;
-
-    case STM32_GPIO_REG_OSPEEDR:
-        s->ospeedr = value;
+    case STM32_GPIO_REG_BRR:
+        if (unlikely(s->family == STM32_F4)) {
+            /* STM32F4xx SoCs do not have this register */
+            stm32_gpio_bad_offset(__func__, "write", offset);
+            return;
+        }
+        s->odr &= ~(value & 0xFFFF);
         break;
 
-    case STM32_GPIO_REG_PUPDR:
-        s->pupdr = value;
+    default:
+        if (stm32_gpio_regs[idx].writable) {
+            *(uint32_t *)((char *)s + stm32_gpio_regs[idx].off) = value;
+        }
+        /* IDR is read-only: writes are silently ignored */
         break;
+    }
 
-    case STM32_GPIO_REG_IDR:
-        break; /* IDR is read-only */
+    if (stm32_gpio_regs[idx].remask) {
+        stm32_gpio_recompute_masks(s);
+    }
 
-    case STM32_GPIO_REG_ODR:
-        s->odr = value; /* IDR is updated in update_state */
-        break;
+    /*
+     * Writes to OTYPER, OSPEEDR, LCKR, AFRL and AFRH can never change
+     * IDR, so they do not need a state update at all.
+     */
+    if (stm32_gpio_regs[idx].dirties) {
+        s->dirty_state = true;
+        qemu_bh_schedule(s->update_bh);
+    }
+}
 
-    case STM32_GPIO_REG_BSRR:
-        s->odr &= ~((value >> 16) & 0xFFFF);
-        /* set bits have higher priority than reset bits */
-        s->odr |= value & 0xFFFF;
-        break;
+/*
+ * Reject accesses while the peripheral is disabled by RCC, before the
+ * read/write callbacks are dispatched at all. The memory core routes
+ * rejected transactions through its standard bad-access handling.
+ */
+static bool stm32_gpio_accepts(void *opaque, hwaddr addr, unsigned size,
+                               bool is_write, MemTxAttrs attrs)
+{
+    return STM32_GPIO(opaque)->enable;
+}
 
-    case STM32_GPIO_REG_LCKR:
-        s->lckr = value;
-        break;
+/*
+ * BSRR is by far the most frequently written GPIO register in real
+ * firmware, so it gets its own 4-byte sub-region overlaid on the main
+ * one: MMIO dispatch lands directly in this handler with no offset
+ * decoding at all.
+ */
+static void stm32_gpio_bsrr_write(void *opaque, hwaddr offset,
+                                  uint64_t value, unsigned int size)
+{
+    STM32GPIOState *s = STM32_GPIO(opaque);
 
-    case STM32_GPIO_REG_AFRL:
-        s->aflr = value;
-        break;
+    trace_stm32_gpio_write(STM32_GPIO_REG_BSRR, value);
 
-    case STM32_GPIO_REG_AFRH:
-        s->afhr = value;
-        break;
+    /* set bits have higher priority than reset bits */
+    s->odr = (s->odr & ~((value >> 16) & 0xFFFF)) | (value & 0xFFFF);
+    s->dirty_state = true;
 
-    case STM32_GPIO_REG_BRR:
-        if (s->family != STM32_F4) {
-            s->odr &= ~(value & 0xFFFF);
-            break;
-        }
-        /* STM32F4xx SoCs do not have this register */
-        qemu_log_mask(
-            LOG_GUEST_ERROR, "%s: bad write offset 0x%" HWADDR_PRIx "\n",
-            __func__, offset
-        );
-        break;
+    qemu_bh_schedule(s->update_bh);
+}
 
-    default:
-        qemu_log_mask(
-            LOG_GUEST_ERROR, "%s: bad write offset 0x%" HWADDR_PRIx "\n",
-            __func__, offset
-        );
-    }
+static uint64_t stm32_gpio_bsrr_read(void *opaque, hwaddr offset,
+                                     unsigned int size)
+{
+    trace_stm32_gpio_read(STM32_GPIO_REG_BSRR, 0);
 
-    stm32_gpio_update_state(s);
+    return 0; /* BSRR is write-only */
 }
 
 static const MemoryRegionOps stm32_gpio_ops = {
     .read =  stm32_gpio_read,
     .write = stm32_gpio_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .unaligned = false,
+        .accepts = stm32_gpio_accepts,
+    },
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+};
+
+static const MemoryRegionOps stm32_gpio_bsrr_ops = {
+    .read =  stm32_gpio_bsrr_read,
+    .write = stm32_gpio_bsrr_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .unaligned = false,
+        .accepts = stm32_gpio_accepts,
+    },
     .impl.min_access_size = 4,
     .impl.max_access_size = 4,
 };
 
+static int stm32_gpio_post_load(void *opaque, int version_id)
+{
+    STM32GPIOState *s = STM32_GPIO(opaque);
+
+    stm32_gpio_recompute_masks(s);
+    /*
+     * The source may have migrated with a state update still pending in
+     * the bottom half, so the migrated IDR can be stale. IDR is fully
+     * derived from migrated fields: recompute it (without re-driving the
+     * pin IRQs), which also re-derives last_irq_out.
+     */
+    s->last_irq_out = s->idr;
+    stm32_gpio_update_state_common(s, true, false);
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_stm32_gpio = {
     .name = TYPE_STM32_GPIO,
     .version_id = 1,
     .minimum_version_id = 1,
+    .post_load = stm32_gpio_post_load,
     .fields = (const VMStateField[]) {
         VMSTATE_UINT32(moder, STM32GPIOState),
         VMSTATE_UINT32(otyper, STM32GPIOState),
@@ -346,14 +502,25 @@ static void stm32_gpio_realize(DeviceState *dev, Error **errp)
 {
     STM32GPIOState *s = STM32_GPIO(dev);
 
+    if (s->ngpio == 0 || s->ngpio > STM32_GPIO_NPINS) {
+        error_setg(errp, "ngpio must be between 1 and %d", STM32_GPIO_NPINS);
+        return;
+    }
+    s->pin_mask = (1u << s->ngpio) - 1;
+
     memory_region_init_io(&s->mmio, OBJECT(dev), &stm32_gpio_ops, s,
                           TYPE_STM32_GPIO, STM32_GPIO_PERIPHERAL_SIZE);
+    memory_region_init_io(&s->bsrr_mmio, OBJECT(dev), &stm32_gpio_bsrr_ops, s,
+                          TYPE_STM32_GPIO ".bsrr", 4);
+    memory_region_add_subregion_overlap(&s->mmio, STM32_GPIO_REG_BSRR,
+                                        &s->bsrr_mmio, 1);
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->mmio);
 
-    qdev_init_gpio_in_named(DEVICE(s), stm32_gpio_irq_reset, "reset-in", 1);
-    qdev_init_gpio_in_named(DEVICE(s), stm32_gpio_irq_enable, "enable-in", 1);
-    qdev_init_gpio_in_named(DEVICE(s), stm32_gpio_irq_set,
-                            "input-in", STM32_GPIO_NPINS);
+    s->update_bh = qemu_bh_new_guarded(stm32_gpio_update_bh, s,
+                                       &dev->mem_reentrancy_guard);
+
+    qdev_init_gpio_in_named(DEVICE(s), stm32_gpio_irq_in, "in",
+                            STM32_GPIO_NLINES);
 
     qdev_init_gpio_out_named(DEVICE(s), &s->state_irq, "state-out", 1);
     qdev_init_gpio_out_named(DEVICE(s), s->input_irq,
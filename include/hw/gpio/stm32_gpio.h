@@ -40,25 +40,30 @@ DECLARE_INSTANCE_CHECKER(STM32GPIOState, STM32_GPIO, TYPE_STM32_GPIO)
 #define STM32_GPIO_NPINS           16
 #define STM32_GPIO_PERIPHERAL_SIZE 0x400
 
+/*
+ * Lines of the consolidated "in" GPIO array: reset and enable from RCC,
+ * followed by one line per external pin input.
+ */
+#define STM32_GPIO_LINE_RESET      0
+#define STM32_GPIO_LINE_ENABLE     1
+#define STM32_GPIO_LINE_INPUT(n)   (2 + (n))
+#define STM32_GPIO_NLINES          STM32_GPIO_LINE_INPUT(STM32_GPIO_NPINS)
+
 struct STM32GPIOState {
     SysBusDevice parent_obj;
 
-    MemoryRegion mmio;
+    /*
+     * Everything read or written by update_state on each state change is
+     * grouped here, ahead of the larger and rarely-touched fields, so
+     * that the hot working set spans as few cache lines as possible.
+     * VMState field order is independent of this layout.
+     */
 
-    /* GPIO registers */
+    /* GPIO registers on the update path */
     uint32_t moder;
-    uint32_t otyper;
-    uint32_t ospeedr;
     uint32_t pupdr;
     uint32_t idr;      /* Actual value of the pin */
     uint32_t odr;      /* Pin value requested by the user */
-    uint32_t lckr;     /* TODO implement locking sequence */
-    uint32_t aflr;
-    uint32_t afhr;
-
-    /* state flags from RCC */
-    bool reset;
-    bool enable;
 
     /* External input */
     uint32_t in;
@@ -68,15 +73,55 @@ struct STM32GPIOState {
      */
     uint32_t in_mask;
 
+    /*
+     * 1-bit-per-pin masks derived from MODER/PUPDR, recomputed on writes
+     * to those registers. Not migrated: rebuilt by post_load.
+     */
+    uint16_t mode_output_mask;
+    uint16_t mode_input_mask;
+    uint16_t pupd_up_mask;
+
+    /* state flags from RCC */
+    bool reset;
+    bool enable;
+
+    /*
+     * Set when a register that may affect IDR has been written since the
+     * last state update. Not migrated: a migrated IDR is already in sync.
+     */
+    bool dirty_state;
+
+    /*
+     * Level last driven on each per-pin input_irq line. Not migrated:
+     * re-derived from IDR by post_load.
+     */
+    uint32_t last_irq_out;
+
+    uint32_t pin_mask; /* (1 << ngpio) - 1, cached at realize time */
+
+    /* Remaining GPIO registers, never read by update_state */
+    uint32_t otyper;
+    uint32_t ospeedr;
+    uint32_t lckr;     /* TODO implement locking sequence */
+    uint32_t aflr;
+    uint32_t afhr;
+
+    MemoryRegion mmio;
+    /* Overlay with a dedicated handler for BSRR, the hottest register */
+    MemoryRegion bsrr_mmio;
+
+    /* Bottom half coalescing state updates for bursts of register writes */
+    QEMUBH *update_bh;
+
     /* IRQ to notify that the GPIO has updated its state */
     qemu_irq state_irq;
     /* IRQs to relay each input pin changes to other STM32 peripherals */
     qemu_irq input_irq[STM32_GPIO_NPINS];
 
     /* config */
-    uint32_t family; /* e.g. STM32_F4 */
-    uint32_t port;   /* e.g. STM32_GPIO_PORT_A */
-    uint32_t ngpio;  /* e.g. 16 */
+    uint32_t family;   /* e.g. STM32_F4 */
+    uint32_t port;     /* e.g. STM32_GPIO_PORT_A */
+    uint32_t ngpio;    /* e.g. 16 */
 };
 
 enum STM32GPIOPort {